@@ -17,6 +17,26 @@
 #define VIEW_ANGLE (M_PI/6.0) // Looking down on the model from (theta) degrees
 #define ROTATION_DEGREES_PER_SECOND 5.0
 #define VIEW_DISTANCE_FACTOR 3 // Looking at origin from (factor) times as far as the farthest body
+#define TIME_WARP_FACTOR 2.0 // The '+' and '-' keys multiply or divide the time warp by (factor)
+
+// Pacing Constants
+#define MAX_BACKLOG_SECONDS 0.1 // When steps are slower than the time warp allows, drop behind rather than catch up on more than this much wall time
+#define MAX_SLEEP_SECONDS 0.01 // Sleep in short slices so that time warp changes take effect promptly
+
+// Kernel Variants
+#define KERNEL_THREADED 0 // Each thread claims chunks of bodies and sums the forces on them from every other body
+#define KERNEL_PAIRWISE 1 // A single thread visits each pair once and applies the force to both bodies
+
+// Autotune Constants
+#define AUTOTUNE_MIN_SECONDS 0.02 // Time each configuration for at least this long...
+#define AUTOTUNE_MAX_STEPS 1000 // ...unless it has already run this many steps
+#define AUTOTUNE_MAX_SECONDS 10.0 // Stop trying new configurations after this long
+#define AUTOTUNE_SAMPLE_BODIES 4096 // Larger systems are timed on this many of their bodies
+#define AUTOTUNE_CACHE_FILE ".nbody_autotune" // Stored in $HOME, or the current directory if $HOME is not set
+
+// Event Constants
+#define EVENT_CELL_GROWTH 2.0 // When a body outgrows the grid, rebuild it with cells (factor) times the required size
+#define EVENT_CELL_SHRINK 2.0 // Also rebuild it once the cells are (factor) times larger than that, so one fast step does not coarsen the grid for good
 
 
 // Structs
@@ -27,13 +47,24 @@ typedef struct {
 			vx, vy, vz; // km/s
 } body_t;
 
+typedef struct {
+	body_t *bodies; // A copy of the bodies after a step
+	double simTime; // s
+	double maxDistance; // km
+	struct timespec wallTime; // When the snapshot was published
+} snapshot_t;
+
 
 
 // Parameters
 double dt = 60 * 60; // 1 hour by default
 double updatesPerSecond = 100.0;
+double timeWarp = 0; // Simulated seconds per wall second; dt * updatesPerSecond unless set
 double largestBodyMinRadius = 0.02; // Minimum radius of the largest body relative to the display size
 double smallestBodyMinRadius = 0.005; // Minimum radius of the smallest body relative to the display size
+int autotuneEnabled = 0; // Pick the kernel, thread count and chunk size by timing them on the loaded bodies
+double closeApproachDistance = 0; // km; close-approach events are detected when this is positive
+char *eventLogFileName = NULL; // Close-approach events are written to stdout when this is not set
 
 // Model Globals
 long iterations = 0;
@@ -41,6 +72,20 @@ body_t *bodies; // Array for body data
 int numBodies; // The total number of bodies
 int bodiesIndex; // The body index that the next thread will use
 pthread_mutex_t indexMutex = PTHREAD_MUTEX_INITIALIZER; // Mutually exlude bodiesIndex for each model thread
+int kernel = KERNEL_THREADED; // The kernel variant used by accelerateBodies
+int numThreads; // The number of threads used by the threaded kernel
+int chunkSize = 1; // The number of bodies a thread claims each time it locks bodiesIndex
+char **bodyNames; // Names of the bodies, for event reporting
+
+// Event Globals
+FILE *eventLog;
+double cellSize = 0; // Edge length of a grid cell in km; zero forces the grid to be built on the next step
+long *cellCoords; // Three per body: the cell holding the midpoint of the body's path during the last step
+int *cellHeads; // Hash table from cell coordinates to the first body of a chain
+int *cellNext, *cellPrev; // Doubly linked chains of the bodies in each hash bucket
+int cellHashMask; // The number of hash buckets minus one
+double *lastVelocities; // Three per body: the velocities used during the previous step
+int lastVelocitiesValid = 0;
 
 // Display Globals
 double maxDistance = 0; // The distance of the furthest body from the origin for display purposes
@@ -49,53 +94,67 @@ double minBodyRadius = INT_MAX; // The maximum body size for display purposes
 int windowWidth;
 int windowHeight;
 double aspectRatio; // Window aspect ratio
-pthread_mutex_t positionsMutex = PTHREAD_MUTEX_INITIALIZER; // Mutually exlude body position reads in the display thread and from writes in the model thread
+snapshot_t snapshots[2];
+snapshot_t *previousSnapshot = &(snapshots[0]); // The display interpolates between these two...
+snapshot_t *latestSnapshot = &(snapshots[1]); // ...or extrapolates beyond the latest when the next step is overdue
+body_t *frameBodies; // The interpolated bodies being drawn, so that drawing does not hold positionsMutex
+double renderTime = 0; // The simulated time being displayed
+struct timespec lastFrameTime; // The wall time the previous frame was drawn
+pthread_mutex_t positionsMutex = PTHREAD_MUTEX_INITIALIZER; // Mutually exlude snapshot and time warp reads in one thread from writes in the other
 
 
 
 // Simulation Functions
+void accelerateBody(int i) {
+	body_t *b1 = &(bodies[i]);
+	double accx = 0;
+	double accy = 0;
+	double accz = 0;
+	for(int j = 0; j < numBodies; j++){
+		body_t *b2 = &(bodies[j]);
+		if (j != i){
+			double xdiff = b2->x - b1->x;
+			double ydiff = b2->y - b1->y;
+			double zdiff = b2->z - b1->z;
+			double diff = sqrt(xdiff * xdiff + ydiff * ydiff + zdiff * zdiff);
+			double temp = b2->mass / (diff * diff * diff);
+			accx += temp * xdiff;
+			accy += temp * ydiff;
+			accz += temp * zdiff;
+		}
+	}
+	b1->vx += GRAVITY_CONST * accx * dt ;
+	b1->vy += GRAVITY_CONST * accy * dt;
+	b1->vz += GRAVITY_CONST * accz * dt;
+}
+
 void *accelerateBodyThread(void *param) {
 	int i;
 	pthread_mutex_lock(&indexMutex);
 		i = bodiesIndex;
-		bodiesIndex++;
+		bodiesIndex += chunkSize;
 	pthread_mutex_unlock(&indexMutex);
 	
 	while(i < numBodies) {
-		body_t *b1 = &(bodies[i]);
-		double accx = 0;
-		double accy = 0;
-		double accz = 0;
-		for(int j = 0; j < numBodies; j++){
-			body_t *b2 = &(bodies[j]);
-			if (j != i){
-				double xdiff = b2->x - b1->x;
-				double ydiff = b2->y - b1->y;
-				double zdiff = b2->z - b1->z;
-				double diff = sqrt(xdiff * xdiff + ydiff * ydiff + zdiff * zdiff);
-				double temp = b2->mass / (diff * diff * diff);
-				accx += temp * xdiff;
-				accy += temp * ydiff;
-				accz += temp * zdiff;
-			}
-		}
-		b1->vx += GRAVITY_CONST * accx * dt ;
-		b1->vy += GRAVITY_CONST * accy * dt;
-		b1->vz += GRAVITY_CONST * accz * dt;
+		int end = i + chunkSize;
+		if(end > numBodies)
+			end = numBodies;
+		for(; i < end; i++)
+			accelerateBody(i);
 		
 		pthread_mutex_lock(&indexMutex);
 			i = bodiesIndex;
-			bodiesIndex++;
+			bodiesIndex += chunkSize;
 		pthread_mutex_unlock(&indexMutex);
 	}
+	return NULL;
 }
 
-void accelerateBodies() {
+void accelerateBodiesThreaded() {
 	// Start threads
 	bodiesIndex = 0;
-	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-	pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-	for(int i = 0; i < num_threads; i++) {
+	pthread_t *threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+	for(int i = 0; i < numThreads; i++) {
 		int rc = pthread_create(&threads[i], NULL, accelerateBodyThread, NULL);
 		if(rc) {
 			printf("ERROR: Return code from pthread_create() is %d.", rc);
@@ -104,7 +163,7 @@ void accelerateBodies() {
 	}
 	
 	// Wait for threads to finish
-	for(int i = 0; i < num_threads; i++) {
+	for(int i = 0; i < numThreads; i++) {
 		int rc = pthread_join(threads[i], NULL);
 		if(rc) {
 			printf("ERROR: Return code from pthread_join() is %d.", rc);
@@ -116,40 +175,416 @@ void accelerateBodies() {
 	free(threads);
 }
 
+void accelerateBodiesPairwise() {
+	// Visiting each pair once halves the work, which wins for small systems where thread start-up would dominate
+	for(int i = 0; i < numBodies; i++) {
+		body_t *b1 = &(bodies[i]);
+		for(int j = i + 1; j < numBodies; j++) {
+			body_t *b2 = &(bodies[j]);
+			double xdiff = b2->x - b1->x;
+			double ydiff = b2->y - b1->y;
+			double zdiff = b2->z - b1->z;
+			double diff = sqrt(xdiff * xdiff + ydiff * ydiff + zdiff * zdiff);
+			double temp = GRAVITY_CONST * dt / (diff * diff * diff);
+			double temp1 = temp * b2->mass;
+			double temp2 = temp * b1->mass;
+			b1->vx += temp1 * xdiff;
+			b1->vy += temp1 * ydiff;
+			b1->vz += temp1 * zdiff;
+			b2->vx -= temp2 * xdiff;
+			b2->vy -= temp2 * ydiff;
+			b2->vz -= temp2 * zdiff;
+		}
+	}
+}
+
+void accelerateBodies() {
+	if(kernel == KERNEL_PAIRWISE)
+		accelerateBodiesPairwise();
+	else
+		accelerateBodiesThreaded();
+}
+
 void moveBodies() {
 	// We do not multithread here because it is a simple computation and threading and mutual exclusion would make it unnecessarily complex.
+	// The display only reads published snapshots, so no lock is needed either.
+	for(int i = 0; i < numBodies; i++) {
+		body_t *b = &(bodies[i]);
+		b->x += b->vx * dt;
+		b->y += b->vy * dt;
+		b->z += b->vz * dt;
+		
+		// While we are here, we might as well compute the maximum distance from the origin for viewing purposes
+		double originDistance = sqrt(b->x * b->x + b->y * b->y + b->z * b->z) + b->radius;
+		if(originDistance > maxDistance)
+			maxDistance = originDistance;
+	}
+}
+
+void publishSnapshot() {
+	// Reuse the older snapshot's buffer for the new one
 	pthread_mutex_lock(&positionsMutex);
+		snapshot_t *snapshot = previousSnapshot;
+		previousSnapshot = latestSnapshot;
+		latestSnapshot = snapshot;
+		memcpy(snapshot->bodies, bodies, numBodies * sizeof(body_t));
+		snapshot->simTime = iterations * dt;
+		snapshot->maxDistance = maxDistance;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &(snapshot->wallTime));
+	pthread_mutex_unlock(&positionsMutex);
+}
+
+// Event Functions
+int cellHash(long cx, long cy, long cz) {
+	unsigned long h = (unsigned long)cx * 73856093UL ^ (unsigned long)cy * 19349663UL ^ (unsigned long)cz * 83492791UL;
+	return (int)(h & cellHashMask);
+}
+
+void gridInsert(int i) {
+	int h = cellHash(cellCoords[3 * i], cellCoords[3 * i + 1], cellCoords[3 * i + 2]);
+	cellPrev[i] = -1;
+	cellNext[i] = cellHeads[h];
+	if(cellHeads[h] >= 0)
+		cellPrev[cellHeads[h]] = i;
+	cellHeads[h] = i;
+}
+
+void gridRemove(int i) {
+	if(cellPrev[i] >= 0)
+		cellNext[cellPrev[i]] = cellNext[i];
+	else
+		cellHeads[cellHash(cellCoords[3 * i], cellCoords[3 * i + 1], cellCoords[3 * i + 2])] = cellNext[i];
+	if(cellNext[i] >= 0)
+		cellPrev[cellNext[i]] = cellPrev[i];
+}
+
+void stepMidpointCell(int i, long *cell) {
+	// Bodies move in a straight line at their current velocity during a step, so the midpoint is half a step back
+	body_t *b = &(bodies[i]);
+	cell[0] = (long)floor((b->x - b->vx * dt / 2) / cellSize);
+	cell[1] = (long)floor((b->y - b->vy * dt / 2) / cellSize);
+	cell[2] = (long)floor((b->z - b->vz * dt / 2) / cellSize);
+}
+
+void initCloseApproaches() {
+	if(eventLogFileName != NULL) {
+		eventLog = fopen(eventLogFileName, "w");
+		if(eventLog == NULL) {
+			fprintf(stderr, "Could not open event log \'%s\'.\n", eventLogFileName);
+			exit(1);
+		}
+	}
+	else
+		eventLog = stdout;
+	fprintf(eventLog, "Time (s),Body 1,Body 2,Distance (km)\n");
+	fflush(eventLog);
+	
+	int numCellHeads = 1;
+	while(numCellHeads < 2 * numBodies)
+		numCellHeads *= 2;
+	cellHashMask = numCellHeads - 1;
+	cellHeads = (int *)malloc(numCellHeads * sizeof(int));
+	cellNext = (int *)malloc(numBodies * sizeof(int));
+	cellPrev = (int *)malloc(numBodies * sizeof(int));
+	cellCoords = (long *)malloc(3 * numBodies * sizeof(long));
+	lastVelocities = (double *)malloc(3 * numBodies * sizeof(double));
+}
+
+int checkCloseApproach(int i, int j, double stepStart) {
+	// Positions are linear in time during a step, so the minimum separation has a closed form
+	body_t *b1 = &(bodies[i]);
+	body_t *b2 = &(bodies[j]);
+	double dvx = b2->vx - b1->vx;
+	double dvy = b2->vy - b1->vy;
+	double dvz = b2->vz - b1->vz;
+	double dx = b2->x - b1->x - dvx * dt;
+	double dy = b2->y - b1->y - dvy * dt;
+	double dz = b2->z - b1->z - dvz * dt;
+	double approachRate = dx * dvx + dy * dvy + dz * dvz;
+	double t;
+	
+	if(lastVelocitiesValid && approachRate >= 0 && dx * (lastVelocities[3 * j] - lastVelocities[3 * i]) + dy * (lastVelocities[3 * j + 1] - lastVelocities[3 * i + 1]) + dz * (lastVelocities[3 * j + 2] - lastVelocities[3 * i + 2]) < 0)
+		t = 0; // The bodies were approaching before this step's kick and separating after it
+	else if(approachRate < 0 && -approachRate < (dvx * dvx + dvy * dvy + dvz * dvz) * dt)
+		t = -approachRate / (dvx * dvx + dvy * dvy + dvz * dvz);
+	else
+		return 0; // The minimum is at the end of the step and is found on the next one
+	
+	dx += dvx * t;
+	dy += dvy * t;
+	dz += dvz * t;
+	double distance = sqrt(dx * dx + dy * dy + dz * dz);
+	if(distance >= closeApproachDistance)
+		return 0;
+	fprintf(eventLog, "%.3f,%s,%s,%.6e\n", stepStart + t, bodyNames[i], bodyNames[j], distance);
+	return 1;
+}
+
+void detectCloseApproaches(double stepStart) {
+	// Any pair that comes within closeApproachDistance during the step has path midpoints at most
+	// closeApproachDistance + maxStepDistance apart, so only neighbouring cells need to be checked
+	double maxStepDistance = 0;
+	for(int i = 0; i < numBodies; i++) {
+		body_t *b = &(bodies[i]);
+		double stepDistance = sqrt(b->vx * b->vx + b->vy * b->vy + b->vz * b->vz) * dt;
+		if(stepDistance > maxStepDistance)
+			maxStepDistance = stepDistance;
+	}
+	
+	// Update the grid, moving only the bodies that changed cells unless the cells have become too small or too large
+	double requiredCellSize = closeApproachDistance + maxStepDistance;
+	if(cellSize < requiredCellSize || cellSize > EVENT_CELL_SHRINK * EVENT_CELL_GROWTH * requiredCellSize) {
+		cellSize = EVENT_CELL_GROWTH * requiredCellSize;
+		for(int h = 0; h <= cellHashMask; h++)
+			cellHeads[h] = -1;
 		for(int i = 0; i < numBodies; i++) {
-			body_t *b = &(bodies[i]);
-			b->x += b->vx * dt;
-			b->y += b->vy * dt;
-			b->z += b->vz * dt;
-			
-			// While we are here, we might as well compute the maximum distance from the origin for viewing purposes
-			double originDistance = sqrt(b->x * b->x + b->y * b->y + b->z * b->z) + b->radius;
-			if(originDistance > maxDistance)
-				maxDistance = originDistance;
+			stepMidpointCell(i, &(cellCoords[3 * i]));
+			gridInsert(i);
 		}
-	pthread_mutex_unlock(&positionsMutex);
+	}
+	else {
+		for(int i = 0; i < numBodies; i++) {
+			long cell[3];
+			stepMidpointCell(i, cell);
+			if(cell[0] != cellCoords[3 * i] || cell[1] != cellCoords[3 * i + 1] || cell[2] != cellCoords[3 * i + 2]) {
+				gridRemove(i);
+				memcpy(&(cellCoords[3 * i]), cell, sizeof(cell));
+				gridInsert(i);
+			}
+		}
+	}
+	
+	// Check each body against the bodies in its own and neighbouring cells
+	int numEvents = 0;
+	for(int i = 0; i < numBodies; i++) {
+		long *cell = &(cellCoords[3 * i]);
+		for(long cx = cell[0] - 1; cx <= cell[0] + 1; cx++)
+			for(long cy = cell[1] - 1; cy <= cell[1] + 1; cy++)
+				for(long cz = cell[2] - 1; cz <= cell[2] + 1; cz++)
+					for(int j = cellHeads[cellHash(cx, cy, cz)]; j >= 0; j = cellNext[j]) {
+						// Hash collisions can put other cells in this chain, so compare coordinates too
+						if(j > i && cellCoords[3 * j] == cx && cellCoords[3 * j + 1] == cy && cellCoords[3 * j + 2] == cz)
+							numEvents += checkCloseApproach(i, j, stepStart);
+					}
+	}
+	if(numEvents > 0)
+		fflush(eventLog);
+	
+	for(int i = 0; i < numBodies; i++) {
+		lastVelocities[3 * i] = bodies[i].vx;
+		lastVelocities[3 * i + 1] = bodies[i].vy;
+		lastVelocities[3 * i + 2] = bodies[i].vz;
+	}
+	lastVelocitiesValid = 1;
 }
 
 void *runSimulationThread(void *param) {
-	struct timespec start, end;
+	// Step whenever the time warp has let a full dt of simulated time pass, independently of the display frame rate
+	struct timespec last, now;
+	double simBudget = 0; // Simulated seconds the simulation may advance before it is ahead of the time warp
+	clock_gettime(CLOCK_MONOTONIC_RAW, &last);
 	while(1) {
-		// Get simulation start time
-		clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		pthread_mutex_lock(&positionsMutex);
+			double warp = timeWarp;
+		pthread_mutex_unlock(&positionsMutex);
+		simBudget += warp * ((now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1000000000.0);
+		last = now;
+		double maxBudget = warp * MAX_BACKLOG_SECONDS;
+		if(maxBudget < dt)
+			maxBudget = dt;
+		if(simBudget > maxBudget)
+			simBudget = maxBudget;
+		
+		// Wait until it is time to update again
+		if(simBudget < dt) {
+			double sleepSeconds = MAX_SLEEP_SECONDS;
+			if(warp > 0 && (dt - simBudget) / warp < sleepSeconds)
+				sleepSeconds = (dt - simBudget) / warp;
+			usleep(sleepSeconds * 1000000);
+			continue;
+		}
+		simBudget -= dt;
 		
 		// Run simulation
 		accelerateBodies();
 		moveBodies();
+		if(closeApproachDistance > 0)
+			detectCloseApproaches(iterations * dt);
 		iterations++;
-		
-		// Wait until it is time to update again
+		publishSnapshot();
+	}
+}
+
+
+
+// Autotune Functions
+void getCpuModel(char *model, int length) {
+	strncpy(model, "unknown", length);
+	FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+	if(cpuinfo == NULL)
+		return;
+	
+	char line[256];
+	while(fgets(line, sizeof(line), cpuinfo) != NULL) {
+		if(strncmp(line, "model name", 10) == 0) {
+			char *value = strchr(line, ':');
+			if(value != NULL) {
+				value++;
+				while(*value == ' ' || *value == '\t')
+					value++;
+				value[strcspn(value, "\n")] = '\0';
+				strncpy(model, value, length);
+			}
+			break;
+		}
+	}
+	model[length - 1] = '\0';
+	fclose(cpuinfo);
+}
+
+void getAutotuneCachePath(char *path, int length) {
+	char *home = getenv("HOME");
+	if(home != NULL)
+		snprintf(path, length, "%s/%s", home, AUTOTUNE_CACHE_FILE);
+	else
+		snprintf(path, length, "%s", AUTOTUNE_CACHE_FILE);
+}
+
+int readAutotuneCache(const char *path, const char *hostName, int numCpus, int sizeBucket, const char *cpuModel) {
+	// Each line is "hostName numCpus sizeBucket kernel threads chunkSize cpuModel"; later lines override earlier ones
+	FILE *cacheFile = fopen(path, "r");
+	if(cacheFile == NULL)
+		return 0;
+	
+	int found = 0;
+	char line[512];
+	while(fgets(line, sizeof(line), cacheFile) != NULL) {
+		char lineHost[256];
+		int lineCpus, lineBucket, lineKernel, lineThreads, lineChunkSize, offset;
+		if(sscanf(line, "%255s %d %d %d %d %d %n", lineHost, &lineCpus, &lineBucket, &lineKernel, &lineThreads, &lineChunkSize, &offset) != 6)
+			continue;
+		char *lineModel = line + offset;
+		lineModel[strcspn(lineModel, "\n")] = '\0';
+		if(strcmp(lineHost, hostName) == 0 && lineCpus == numCpus && lineBucket == sizeBucket && strcmp(lineModel, cpuModel) == 0 && lineThreads > 0 && lineChunkSize > 0) {
+			kernel = lineKernel == KERNEL_PAIRWISE ? KERNEL_PAIRWISE : KERNEL_THREADED;
+			numThreads = lineThreads < numCpus ? lineThreads : numCpus;
+			chunkSize = lineChunkSize;
+			found = 1;
+		}
+	}
+	fclose(cacheFile);
+	return found;
+}
+
+void writeAutotuneCache(const char *path, const char *hostName, int numCpus, int sizeBucket, const char *cpuModel) {
+	FILE *cacheFile = fopen(path, "a");
+	if(cacheFile == NULL) {
+		fprintf(stderr, "Could not write autotune cache \'%s\'.\n", path);
+		return;
+	}
+	fprintf(cacheFile, "%s %d %d %d %d %d %s\n", hostName, numCpus, sizeBucket, kernel, numThreads, chunkSize, cpuModel);
+	fclose(cacheFile);
+}
+
+double timeConfiguration(const body_t *savedBodies) {
+	// Returns the average seconds per accelerateBodies() call, then restores the velocities it changed
+	struct timespec start, end;
+	double elapsed;
+	int steps = 0;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	do {
+		accelerateBodies();
+		steps++;
 		clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-		long sleepTime = 1000000 / updatesPerSecond + (start.tv_sec - end.tv_sec) * 1000000 + (start.tv_nsec - end.tv_nsec) / 1000;
-		if(sleepTime > 0)
-			usleep(sleepTime * 1000000 / CLOCKS_PER_SEC);
+		elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+	} while(elapsed < AUTOTUNE_MIN_SECONDS && steps < AUTOTUNE_MAX_STEPS);
+	memcpy(bodies, savedBodies, numBodies * sizeof(body_t));
+	return elapsed / steps;
+}
+
+void autotune() {
+	// Results are shared between runs on the same host and CPUs whose body counts fall in the same power of two,
+	// since $HOME may be shared between hosts and containers or taskset may limit the CPUs available
+	int sizeBucket = 0;
+	while((2 << sizeBucket) <= numBodies)
+		sizeBucket++;
+	char cpuModel[256];
+	getCpuModel(cpuModel, sizeof(cpuModel));
+	int numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	char hostName[256];
+	if(gethostname(hostName, sizeof(hostName)) != 0 || hostName[0] == '\0')
+		strcpy(hostName, "unknown");
+	hostName[sizeof(hostName) - 1] = '\0';
+	char cachePath[4096];
+	getAutotuneCachePath(cachePath, sizeof(cachePath));
+	
+	if(readAutotuneCache(cachePath, hostName, numCpus, sizeBucket, cpuModel)) {
+		fprintf(stderr, "Autotune: using cached %s kernel, %d threads, chunk size %d.\n", kernel == KERNEL_PAIRWISE ? "pairwise" : "threaded", numThreads, chunkSize);
+		return;
+	}
+	
+	// Both kernels are O(N^2) per step, so a sample of a large system ranks the configurations at a fraction of the cost
+	int totalBodies = numBodies;
+	if(numBodies > AUTOTUNE_SAMPLE_BODIES)
+		numBodies = AUTOTUNE_SAMPLE_BODIES;
+	body_t *savedBodies = (body_t *)malloc(numBodies * sizeof(body_t));
+	memcpy(savedBodies, bodies, numBodies * sizeof(body_t));
+	int maxThreads = numCpus;
+	if(maxThreads > numBodies)
+		maxThreads = numBodies;
+	struct timespec tuneStart, now;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tuneStart);
+	
+	// The pairwise kernel is single threaded, so it is timed once
+	kernel = KERNEL_PAIRWISE;
+	numThreads = 1;
+	chunkSize = 1;
+	double bestTime = timeConfiguration(savedBodies);
+	int bestKernel = kernel, bestThreads = numThreads, bestChunkSize = chunkSize;
+	
+	// Try the number of processors first, then the powers of two below it, so a good time is found early
+	kernel = KERNEL_THREADED;
+	int threads = maxThreads;
+	int timedOut = 0;
+	while(!timedOut) {
+		for(int chunk = 1; chunk <= numBodies; chunk *= 4) {
+			clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+			if((now.tv_sec - tuneStart.tv_sec) + (now.tv_nsec - tuneStart.tv_nsec) / 1000000000.0 > AUTOTUNE_MAX_SECONDS) {
+				timedOut = 1;
+				break;
+			}
+			
+			numThreads = threads;
+			chunkSize = chunk;
+			double stepTime = timeConfiguration(savedBodies);
+			if(stepTime < bestTime) {
+				bestTime = stepTime;
+				bestKernel = kernel;
+				bestThreads = numThreads;
+				bestChunkSize = chunkSize;
+			}
+			
+			// A single thread claims every chunk itself, and chunks larger than an even split between threads only leave threads idle
+			if(threads == 1 || chunk * threads >= numBodies)
+				break;
+		}
+		
+		if(threads == 1)
+			break;
+		int nextThreads = 1;
+		while(nextThreads * 2 < threads)
+			nextThreads *= 2;
+		threads = nextThreads;
 	}
+	free(savedBodies);
+	numBodies = totalBodies;
+	
+	kernel = bestKernel;
+	numThreads = bestThreads;
+	chunkSize = bestChunkSize;
+	fprintf(stderr, "Autotune: chose %s kernel, %d threads, chunk size %d (%.3e s per step on %d bodies%s).\n", kernel == KERNEL_PAIRWISE ? "pairwise" : "threaded", numThreads, chunkSize, bestTime, totalBodies < AUTOTUNE_SAMPLE_BODIES ? totalBodies : AUTOTUNE_SAMPLE_BODIES, timedOut ? ", search cut short" : "");
+	writeAutotuneCache(cachePath, hostName, numCpus, sizeBucket, cpuModel);
 }
 
 
@@ -162,43 +597,78 @@ void displayDrawCallback() {
 		struct timespec t;
 		clock_gettime(CLOCK_MONOTONIC_RAW, &t);
 		glRotated(fmod(ROTATION_DEGREES_PER_SECOND * (t.tv_sec + t.tv_nsec / 1000000000.0), 360), 0, 0, 1);
+		double frameSeconds = (t.tv_sec - lastFrameTime.tv_sec) + (t.tv_nsec - lastFrameTime.tv_nsec) / 1000000000.0;
+		lastFrameTime = t;
 		
 		pthread_mutex_lock(&positionsMutex);
-			// Compute Radius Resize Parameters
-			double rFactor = 1;
-			double rConstant = 0;
-			double lbmr = largestBodyMinRadius * maxDistance;
-			double sbmr = smallestBodyMinRadius * maxDistance;
-			if(maxBodyRadius < lbmr) // Favor proportional increases required by the largest body
-				rFactor = lbmr / maxBodyRadius;
-			if(rFactor * minBodyRadius < sbmr) { // Check smallest body requirements and adjust as needed
-				rFactor = (lbmr - sbmr) / (maxBodyRadius - minBodyRadius);
-				rConstant = sbmr - rFactor * minBodyRadius;
-			}
+			// Advance the render clock, keeping it between the two most recent snapshots so the display trails the simulation by a step.
+			// Only when the next step is overdue does it run up to one step past the latest snapshot.
+			double warp = timeWarp;
+			renderTime += warp * frameSeconds;
+			double maxRenderTime = latestSnapshot->simTime;
+			if(warp * ((t.tv_sec - latestSnapshot->wallTime.tv_sec) + (t.tv_nsec - latestSnapshot->wallTime.tv_nsec) / 1000000000.0) > dt)
+				maxRenderTime += dt;
+			if(renderTime > maxRenderTime)
+				renderTime = maxRenderTime;
+			if(renderTime < previousSnapshot->simTime)
+				renderTime = previousSnapshot->simTime;
+			double interval = latestSnapshot->simTime - previousSnapshot->simTime;
+			double fraction = interval > 0 ? (renderTime - previousSnapshot->simTime) / interval : 1;
+			double extrapolation = renderTime - latestSnapshot->simTime;
 			
-			// Draw Bodies
+			// Compute this frame's positions, leaving the drawing until the lock is released
 			for(int i = 0; i < numBodies; i++) {
-				body_t b = bodies[i];
-				
-				// Draw Body
-				glColor3d(0, 1, 0);
-				glPushMatrix();
-					glTranslated(b.x, b.y, b.z);
-					glutSolidSphere(rFactor * b.radius + rConstant, 10, 10);
-				glPopMatrix();
-				
-				// Draw line from body to x-y plane to better illustrate depth
-				glColor3d(1, 0, 0);
-				glBegin(GL_LINES);
-					glVertex3d(b.x, b.y, b.z);
-					glVertex3d(b.x, b.y, 0);
-				glEnd();
+				body_t *b = &(frameBodies[i]);
+				*b = latestSnapshot->bodies[i];
+				if(extrapolation > 0) { // The simulation has fallen behind the display, so carry on at the latest velocity
+					b->x += b->vx * extrapolation;
+					b->y += b->vy * extrapolation;
+					b->z += b->vz * extrapolation;
+				}
+				else { // Interpolate between the positions in the two most recent snapshots
+					body_t *p = &(previousSnapshot->bodies[i]);
+					b->x = p->x + (b->x - p->x) * fraction;
+					b->y = p->y + (b->y - p->y) * fraction;
+					b->z = p->z + (b->z - p->z) * fraction;
+				}
 			}
 			
-			// Save a local copy of maxDistance
-			double localMD = maxDistance;
+			// Save local copies of the other values this frame needs
+			double localMD = latestSnapshot->maxDistance;
+			double timeElapsed = renderTime;
 		pthread_mutex_unlock(&positionsMutex);
 		
+		// Compute Radius Resize Parameters
+		double rFactor = 1;
+		double rConstant = 0;
+		double lbmr = largestBodyMinRadius * localMD;
+		double sbmr = smallestBodyMinRadius * localMD;
+		if(maxBodyRadius < lbmr) // Favor proportional increases required by the largest body
+			rFactor = lbmr / maxBodyRadius;
+		if(rFactor * minBodyRadius < sbmr) { // Check smallest body requirements and adjust as needed
+			rFactor = (lbmr - sbmr) / (maxBodyRadius - minBodyRadius);
+			rConstant = sbmr - rFactor * minBodyRadius;
+		}
+		
+		// Draw Bodies
+		for(int i = 0; i < numBodies; i++) {
+			body_t b = frameBodies[i];
+			
+			// Draw Body
+			glColor3d(0, 1, 0);
+			glPushMatrix();
+				glTranslated(b.x, b.y, b.z);
+				glutSolidSphere(rFactor * b.radius + rConstant, 10, 10);
+			glPopMatrix();
+			
+			// Draw line from body to x-y plane to better illustrate depth
+			glColor3d(1, 0, 0);
+			glBegin(GL_LINES);
+				glVertex3d(b.x, b.y, b.z);
+				glVertex3d(b.x, b.y, 0);
+			glEnd();
+		}
+		
 		// Draw axes
 		glPushMatrix();
 			glBegin(GL_LINES);
@@ -237,13 +707,12 @@ void displayDrawCallback() {
 			glLoadIdentity();
 			glRasterPos2i(10, 10);
 			
-			char str[30];
-			double timeElapsed = iterations * dt;
+			char str[128];
 			long days = (long)timeElapsed / (60 * 60 * 24);
 			int hours = (long)timeElapsed / (60 * 60) % 24;
 			int minutes = (long)timeElapsed / 60 % 60;
 			double seconds = fmod(timeElapsed, 60);
-			sprintf(str, "View Radius: %.4e km     Day: %d     Time: %02d:%02d:%05.02f", maxDistance, days, hours, minutes, seconds);
+			snprintf(str, sizeof(str), "View Radius: %.4e km     Day: %ld     Time: %02d:%02d:%05.02f     Warp: %.2e s/s", localMD, days, hours, minutes, seconds, warp);
 			for(int i = 0; i < strlen(str); i++)
 				glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, str[i]);
 			
@@ -264,6 +733,20 @@ void displayReshapeCallback(int width, int height) {
 	aspectRatio = (double)width / (double)height;
 }
 
+void displayKeyboardCallback(unsigned char key, int x, int y) {
+	pthread_mutex_lock(&positionsMutex);
+		switch(key) {
+			case '+':
+			case '=':
+				timeWarp *= TIME_WARP_FACTOR;
+				break;
+			case '-':
+				timeWarp /= TIME_WARP_FACTOR;
+				break;
+		}
+	pthread_mutex_unlock(&positionsMutex);
+}
+
 
 
 //Main Function
@@ -279,7 +762,7 @@ int main(int argc, char *argv[]) {
 	strcpy(dataFileName, argv[1]);
 	
 	int option;
-	while((option = getopt(argc, argv, "t:u:l:s:")) != -1) {
+	while((option = getopt(argc, argv, "t:u:w:l:s:ac:e:")) != -1) {
 		switch(option) {
 			case 't':
 				dt = atof(optarg);
@@ -287,18 +770,34 @@ int main(int argc, char *argv[]) {
 			case 'u':
 				updatesPerSecond = atof(optarg);
 				break;
+			case 'w':
+				timeWarp = atof(optarg);
+				break;
 			case 'l':
 				largestBodyMinRadius = atof(optarg);
 				break;
 			case 's':
 				smallestBodyMinRadius = atof(optarg);
 				break;
+			case 'a':
+				autotuneEnabled = 1;
+				break;
+			case 'c':
+				closeApproachDistance = atof(optarg);
+				break;
+			case 'e':
+				eventLogFileName = optarg;
+				break;
 			case '?':
 				return 1;
 			default:
 				abort();
 		}
 	}
+	if(eventLogFileName != NULL && closeApproachDistance <= 0) {
+		fprintf(stderr, "An event log (-e) requires a positive close-approach distance (-c).\n");
+		return 1;
+	}
 	
 	// Check File
 	FILE *dataFile;
@@ -316,6 +815,7 @@ int main(int argc, char *argv[]) {
 	
 	// Load Body Data
 	bodies = (body_t *)malloc(numBodies * sizeof(body_t));
+	bodyNames = (char **)malloc(numBodies * sizeof(char *));
 	CsvParser *csvparser = CsvParser_new(dataFileName, ",", 1);
 	CsvRow *row;
 	const CsvRow *header = CsvParser_getHeader(csvparser);
@@ -330,6 +830,7 @@ int main(int argc, char *argv[]) {
 		const char **rowFields = CsvParser_getFields(row);
 		
 		body_t *b = &(bodies[i]);
+		bodyNames[i] = strdup(rowFields[0]);
 		b->mass = atof(rowFields[1]);
 		b->radius = atof(rowFields[2]);
 		b->x = atof(rowFields[3]);
@@ -343,12 +844,37 @@ int main(int argc, char *argv[]) {
 			minBodyRadius = b->radius;
 		if(b->radius > maxBodyRadius)
 			maxBodyRadius = b->radius;
+		double originDistance = sqrt(b->x * b->x + b->y * b->y + b->z * b->z) + b->radius;
+		if(originDistance > maxDistance)
+			maxDistance = originDistance;
 		
 		CsvParser_destroy_row(row);
 		i++;
 	}
 	CsvParser_destroy(csvparser);
 	
+	// Choose Simulation Kernel
+	numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(autotuneEnabled)
+		autotune();
+	
+	// Set Up Event Detection
+	if(closeApproachDistance > 0)
+		initCloseApproaches();
+	
+	// Publish Initial Bodies
+	if(timeWarp <= 0)
+		timeWarp = dt * updatesPerSecond;
+	for(int i = 0; i < 2; i++) {
+		snapshots[i].bodies = (body_t *)malloc(numBodies * sizeof(body_t));
+		memcpy(snapshots[i].bodies, bodies, numBodies * sizeof(body_t));
+		snapshots[i].simTime = 0;
+		snapshots[i].maxDistance = maxDistance;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &(snapshots[i].wallTime));
+	}
+	frameBodies = (body_t *)malloc(numBodies * sizeof(body_t));
+	clock_gettime(CLOCK_MONOTONIC_RAW, &lastFrameTime);
+	
 	// Start Simulation Thread
 	pthread_t model_thread;
 	int rc = pthread_create(&model_thread, NULL, runSimulationThread, NULL);
@@ -368,6 +894,7 @@ int main(int argc, char *argv[]) {
 	// Initialize Display Callbacks
 	glutDisplayFunc(displayDrawCallback);
 	glutReshapeFunc(displayReshapeCallback);
+	glutKeyboardFunc(displayKeyboardCallback);
 	glutIdleFunc(glutPostRedisplay);
 	
 	// Setup Lighting
@@ -384,5 +911,11 @@ int main(int argc, char *argv[]) {
 	glutMainLoop(); // This function never returns. #YOLO
 	
 	// Clean Up
+	for(int i = 0; i < numBodies; i++)
+		free(bodyNames[i]);
+	free(bodyNames);
+	free(snapshots[0].bodies);
+	free(snapshots[1].bodies);
+	free(frameBodies);
 	free(bodies);
 }